@@ -6,15 +6,42 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#if defined(ROBOIO_TRACE) || !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 
 #define BOARD_ROWS 20
 #define BOARD_COLS 100 
 #define MAX_NAME 20
+#define LEADERBOARD_SIZE 10 // Number of players shown on the leaderboard
 #define ROBOT_BODY "o"
 #define ROBOT_HEAD "^"
 #define PERSON 'o'
 #define MINE '.'
 #define NEW_LIFE 'N'
+#define STATS_FILE "player_stats.dat"
+#define STATS_MAGIC "RBSTATS1"
+#define STATS_INITIAL_CAPACITY 1024 // Number of player slots in a new stats file, doubled when it gets 3/4 full
+#define MOST_IMPROVED 5 // Number of players kept on the most improved board
+#define FOV_RADIUS 8 // Sensor radius of the robot in fog of war mode
+#define FOV_WORDS ((BOARD_COLS + 63) / 64) // 64-bit words needed to hold one board row
+#define BROADCAST_SOCKET "/tmp/roboio.sock" // Default socket spectators connect to
+#define MAX_SPECTATORS 32
+#define KEYFRAME_INTERVAL 50 // Frames between two full frames
+#define FRAME_KEY 1
+#define FRAME_DIFF 2
+#define FRAME_REFUSED 3 // Sent instead of frames when the game already has MAX_SPECTATORS
 
 
 // Structs
@@ -33,6 +60,8 @@ typedef struct {
     int score;
     int lives;
     int level;
+    int deaths_wall;
+    int deaths_mine;
 } Player;
 
 typedef struct {
@@ -40,33 +69,238 @@ typedef struct {
     int score;
 } Leaderboard;
 
+// Aggregated statistics of a player, updated in place after every game
+typedef struct {
+    char name[MAX_NAME];
+    int games_played; // 0 means the slot is empty
+    int best_score;
+    int first_score;
+    int highest_level;
+    int total_rescued; // Also the sum of all scores, so the average is total_rescued / games_played
+    int deaths_wall;
+    int deaths_mine;
+} PlayerStats;
+
+typedef struct {
+    char name[MAX_NAME];
+    int improvement; // best_score - first_score, which can only go up
+} ImprovedEntry;
+
+// The stats file is this header followed by a hash table of 'capacity' PlayerStats slots keyed by name
+typedef struct {
+    char magic[8];
+    int capacity;
+    int count;
+    ImprovedEntry most_improved[MOST_IMPROVED]; // Kept sorted, highest improvement first
+} StatsHeader;
+
+// What the robot can see in fog of war mode, one bit per board cell
+typedef struct {
+    int enabled;
+    int dirty; // Set when the mines moved and the view has to be recomputed
+    int origin_x; // Robot cell the view was computed from
+    int origin_y;
+    uint64_t visible[BOARD_ROWS][FOV_WORDS];
+    uint64_t opaque[BOARD_ROWS][FOV_WORDS]; // Cells holding a mine, which block the sensor
+} FieldOfView;
+
+#define FOV_TEST(bits, x, y) (((bits)[(y)][(x) / 64] >> ((x) % 64)) & 1)
+#define FOV_SET(bits, x, y) ((bits)[(y)][(x) / 64] |= (uint64_t)1 << ((x) % 64))
+
+// Spectator broadcast
+// Every frame is diff-encoded once into 'packet' and the same bytes are sent to every spectator
+typedef struct {
+    unsigned char ch; // 0 for an empty cell
+    unsigned char color;
+} FrameCell;
+
+typedef struct {
+    uint8_t x;
+    uint8_t y;
+    uint8_t ch;
+    uint8_t color;
+} FrameUpdate;
+
+typedef struct {
+    uint8_t type; // FRAME_KEY, FRAME_DIFF or FRAME_REFUSED
+    uint8_t reserved;
+    uint16_t update_count; // Number of FrameUpdate following the header
+    uint32_t frame;
+    int16_t lives;
+    int16_t score;
+    int16_t level;
+    char name[MAX_NAME];
+} FrameHeader;
+
+typedef struct {
+    int listen_fd; // -1 when broadcasting is off
+    int spectators[MAX_SPECTATORS];
+    int synced[MAX_SPECTATORS]; // Set once a spectator has received a keyframe
+    int spectator_count;
+    int force_keyframe;
+    uint32_t frame;
+    char path[108];
+    FrameCell previous[BOARD_ROWS][BOARD_COLS];
+    FrameCell current[BOARD_ROWS][BOARD_COLS];
+    unsigned char packet[sizeof(FrameHeader) + BOARD_ROWS * BOARD_COLS * sizeof(FrameUpdate)];
+} Broadcast;
+
+// Trace recorder (build with -DROBOIO_TRACE)
+// Every record has the same fixed size so that recording is a single struct copy into the ring buffer
+#define TRACE_FILE "roboio.trace"
+#define TRACE_MAGIC "RBTRACE1"
+#define TRACE_CAPACITY 65536 // Number of records kept, the oldest ones are overwritten when the buffer is full
+
+typedef struct {
+    uint64_t timestamp; // Microseconds since the recorder started
+    uint16_t type;
+    int16_t x;
+    int16_t y;
+    uint16_t value;
+} TraceEvent;
+
+enum {
+    TRACE_PHASE_BEGIN = 1, // value = phase
+    TRACE_PHASE_END,       // value = phase
+    TRACE_DIRECTION,       // value = new direction chosen by the player
+    TRACE_AI_DECISION,     // value = direction chosen by the AI
+    TRACE_AI_FALLBACK,     // value = direction kept because no safe move was found
+    TRACE_COLLISION,       // value = 1 for a wall, 2 for a mine
+    TRACE_RESCUE,          // value = new score
+    TRACE_LEVEL_UP,        // value = new level as shown on screen, x = mine count
+    TRACE_MINE_SHUFFLE     // value = mine count
+};
+
+enum {
+    PHASE_TICK = 0,
+    PHASE_RENDER,
+    PHASE_LEVEL,
+    PHASE_INPUT,
+    PHASE_MOVE,
+    PHASE_COLLISION,
+    PHASE_RESCUE,
+    PHASE_SLEEP,
+    PHASE_BROADCAST
+};
+
+#ifdef ROBOIO_TRACE
+#define TRACE_EVENT(type, x, y, value) trace_record((type), (x), (y), (value))
+#define TRACE_BEGIN(phase) trace_record(TRACE_PHASE_BEGIN, 0, 0, (phase))
+#define TRACE_END(phase) trace_record(TRACE_PHASE_END, 0, 0, (phase))
+#else
+#define TRACE_EVENT(type, x, y, value) ((void)0)
+#define TRACE_BEGIN(phase) ((void)0)
+#define TRACE_END(phase) ((void)0)
+#endif
+
+// Allocation audit (build with -DROBOIO_AUDIT)
+// Counts every allocation and window made by the game and fails at exit if any tick allocates
+
+enum {
+    AUDIT_SETUP = 0,
+    AUDIT_TICK,
+    AUDIT_GAME_OVER,
+    AUDIT_PHASES
+};
+
+#ifdef ROBOIO_AUDIT
+void *audit_malloc(size_t size, int line);
+void *audit_realloc(void *pointer, size_t size, int line);
+void audit_free(void *pointer);
+WINDOW *audit_newwin(int rows, int cols, int y, int x, int line);
+int audit_delwin(WINDOW *window);
+void audit_set_phase(int phase);
+void audit_tick_begin(void);
+void audit_tick_end(void);
+int audit_report(void);
+
+#define malloc(size) audit_malloc((size), __LINE__)
+#define realloc(pointer, size) audit_realloc((pointer), (size), __LINE__)
+#define free(pointer) audit_free(pointer)
+#define newwin(rows, cols, y, x) audit_newwin((rows), (cols), (y), (x), __LINE__)
+#define delwin(window) audit_delwin(window)
+#define AUDIT_PHASE(phase) audit_set_phase(phase)
+#define AUDIT_TICK_BEGIN() audit_tick_begin()
+#define AUDIT_TICK_END() audit_tick_end()
+#else
+#define AUDIT_PHASE(phase) ((void)0)
+#define AUDIT_TICK_BEGIN() ((void)0)
+#define AUDIT_TICK_END() ((void)0)
+#endif
+
 
 // Function prototypes
 WINDOW* init_game(Player player, Robot robot, Position person, Position *mines, int mine_count);  
+void clear_board(WINDOW *board);
 void draw_title_screen(Player *player);
 void draw_second_screen(Player *player);
 void update_UI(Player player, Robot robot, Position person, Position *mines, int mine_count);
-void handle_input(Robot *robot, int input, Position *person, Position *mines, int mine_count, WINDOW *board);
+void handle_input(Robot *robot, int input, Position *person, Position *mines, int mine_count, WINDOW *board, FieldOfView *fov);
 void move_robot(Robot *robot, Position *person);
-void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_count);
+void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_count, FieldOfView *fov);
 void clear_robot(Robot *robot);
 void clear_mines(Position *mines, int mine_count);
 void clear_person(Position *person);
 void draw_robot(Robot *robot, WINDOW* board);
 int check_collision(Robot *robot, Position *mines, int mine_count);
-void spawn_person(Position *person);
-void spawn_mines(Position *mines, int *mine_count);
+void spawn_person(Position *person, FieldOfView *fov);
+void spawn_mines(Position *mines, int *mine_count, FieldOfView *fov);
 void game_over_screen(Player *player, Leaderboard *leaderboard);
 void save_score(Player *player);
 void show_leaderboard(Leaderboard *leaderboard);
+void update_player_stats(Player *player);
+int load_player_stats(const char *name, PlayerStats *stats, StatsHeader *header);
+void show_player_stats(Player *player);
 void random_coordinates_mines(int mine_count, Position *mines, Position *person, Robot *robot);
 void random_coordinates_person(int mine_count, Position *mines, Position *person, Robot *robot);
-void sort_leaderboard(Leaderboard *leaderboard, int num);
+void insert_leaderboard(Leaderboard *leaderboard, int *count, const char *name, int score);
 int absolute_distance(int robot_x, int robot_y, int person_x, int person_y, int xmax, int ymax);
 void draw_commander(int xmax, int ymax);
 void draw_soldier(int xmax, int ymax);
+void fov_set_mines(FieldOfView *fov, Position *mines, int mine_count);
+void fov_update(FieldOfView *fov, Robot *robot);
+int fov_can_see(FieldOfView *fov, int screen_x, int screen_y);
+int fov_visible_mine(FieldOfView *fov, int x, int y);
+int broadcast_start(Broadcast *broadcast, const char *path);
+void broadcast_frame(Broadcast *broadcast, Player *player, Robot *robot, Position *person, Position *mines, int mine_count, FieldOfView *fov);
+void broadcast_stop(Broadcast *broadcast);
+int spectate(const char *path, const char *record_path);
+void trace_start(void);
+void trace_record(int type, int x, int y, int value);
+int trace_dump(void);
+int trace_to_chrome(const char *trace_path, const char *json_path);
+
+int main(int argc, char *argv[]) {
+    // Convert a recorded trace to Chrome/Perfetto JSON without starting the game
+    if (argc == 4 && strcmp(argv[1], "--trace-json") == 0){
+        return trace_to_chrome(argv[2], argv[3]);
+    }
+
+    FieldOfView fov = {.enabled = 0};
+    Broadcast broadcast = {.listen_fd = -1};
+    const char *broadcast_path = NULL;
+    const char *spectate_path = NULL;
+    const char *record_path = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--fog") == 0){
+            fov.enabled = 1; // The robot only sees mines and people within its sensor radius
+        } else if (strcmp(argv[i], "--broadcast") == 0){
+            broadcast_path = (i + 1 < argc && argv[i+1][0] != '-') ? argv[++i] : BROADCAST_SOCKET;
+        } else if (strcmp(argv[i], "--spectate") == 0){
+            spectate_path = (i + 1 < argc && argv[i+1][0] != '-') ? argv[++i] : BROADCAST_SOCKET;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            record_path = argv[++i];
+        }
+    }
+
+    // Watch a game broadcast by another process instead of playing
+    if (spectate_path != NULL){
+        return spectate(spectate_path, record_path);
+    }
+    if (broadcast_path != NULL && broadcast_start(&broadcast, broadcast_path) != 0){
+        return 1;
+    }
 
-int main() {
     // Initialize ncurses
     initscr();
     cbreak();
@@ -75,6 +309,9 @@ int main() {
     curs_set(0);
     srand(time(NULL));
     nodelay(stdscr, FALSE); 
+#ifdef ROBOIO_TRACE
+    trace_start(); // Started after initscr so the ncurses signal handlers can be chained
+#endif
 
     if (!has_colors()){
         addstr("Your system does not support colours!"); //Check if the system supports colors
@@ -103,7 +340,7 @@ int main() {
         printw("Memory allocation failed!\n"); // Check if memory allocation failed
         return -1;
     }
-    Leaderboard leaderboard;
+    Leaderboard leaderboard[LEADERBOARD_SIZE];
     int collision = 0;
     int mine_count = 5;
     int delay = 250000;
@@ -129,20 +366,28 @@ int main() {
     random_coordinates_mines(mine_count, mines, &person, &robot);
     random_coordinates_person(mine_count, mines, &person, &robot);
     clear_robot(&robot); // Clear robot's position
+    fov_set_mines(&fov, mines, mine_count);
    
     int ch;
     int flag_mines, flag_score = 0; // Variable to ensure that the mines spawn only once at each level
     int flag_newlife = 0;
 
     //Game loop
+    AUDIT_PHASE(AUDIT_TICK);
     while (1) {
+        AUDIT_TICK_BEGIN();
+        TRACE_BEGIN(PHASE_TICK);
+        TRACE_BEGIN(PHASE_RENDER);
+        fov_update(&fov, &robot); // Only does work when the robot moved or the mines changed
         update_UI(player, robot, person, mines, mine_count);
-        spawn_mines(mines, &mine_count);
-        spawn_person(&person);
+        spawn_mines(mines, &mine_count, &fov);
+        spawn_person(&person, &fov);
         
         refresh();
+        TRACE_END(PHASE_RENDER);
         
         //Check for level increment
+        TRACE_BEGIN(PHASE_LEVEL);
         if (player.score != 0 && player.score % 5 == 0 && player.score != flag_score){
             player.level += 1;
             if (flag_newlife == 1){
@@ -155,11 +400,17 @@ int main() {
             }
             if (mine_count <= 48){
                 mine_count += 2; // Increase mine_count by 2
+                TRACE_EVENT(TRACE_LEVEL_UP, mine_count, 0, player.level + 1); // Level as shown on screen
             } else {
+                TRACE_EVENT(TRACE_LEVEL_UP, mine_count, 0, player.level + 1); // Level as shown on screen
+                TRACE_END(PHASE_LEVEL);
+                TRACE_END(PHASE_TICK);
+                AUDIT_TICK_END();
                 break; // Exit the loop as maximum score reached
             }
             clear_robot(&robot); // Bring robot to the center
             random_coordinates_mines(mine_count, mines, &person, &robot); // Generate new random cordinates for the mines
+            fov_set_mines(&fov, mines, mine_count);
             wclear(stdscr);
             refresh();
             attrset(COLOR_PAIR(2));
@@ -176,24 +427,36 @@ int main() {
         if (player.score % 2 == 0 && player.score != 0 && flag_mines != player.score){
             clear_mines(mines, mine_count);
             random_coordinates_mines(mine_count, mines, &person, &robot);
-            spawn_mines(mines, &mine_count);
+            fov_set_mines(&fov, mines, mine_count);
+            fov_update(&fov, &robot);
+            spawn_mines(mines, &mine_count, &fov);
             flag_mines = player.score;
+            TRACE_EVENT(TRACE_MINE_SHUFFLE, 0, 0, mine_count);
             refresh();
         }
+        TRACE_END(PHASE_LEVEL);
 
         // Handle input
         if (ch == 'q' || player.lives == 0){
+            TRACE_END(PHASE_TICK);
+            AUDIT_TICK_END();
             break; //break out of the loop 
         }
 
+        TRACE_BEGIN(PHASE_INPUT);
         ch = getch();
-        handle_input(&robot, ch, &person, mines, mine_count,board);
+        handle_input(&robot, ch, &person, mines, mine_count,board, &fov);
+        TRACE_END(PHASE_INPUT);
+        TRACE_BEGIN(PHASE_MOVE);
         move_robot(&robot, &person);
         draw_robot(&robot, board);
         refresh();
+        TRACE_END(PHASE_MOVE);
         // Check for collision
+        TRACE_BEGIN(PHASE_COLLISION);
         collision = check_collision(&robot, mines, mine_count);
         if (collision != 0){
+            TRACE_EVENT(TRACE_COLLISION, robot.pos.x, robot.pos.y, collision);
             mvaddstr(ymax/2, xmax/2 - 20, "You lost a life! Press any key to continue playing!");
             clear_robot(&robot); // Reposition the robot to the center
             nodelay(stdscr, FALSE);
@@ -202,37 +465,70 @@ int main() {
             clear();
             refresh();
             player.lives -= 1;
+            if (collision == 1){
+                player.deaths_wall += 1;
+            } else {
+                player.deaths_mine += 1;
+            }
         }
+        TRACE_END(PHASE_COLLISION);
 
 
         // If robot rescued a person, add points
+        TRACE_BEGIN(PHASE_RESCUE);
         if (robot.pos.x + (xmax-BOARD_COLS)/2 + BOARD_COLS/2== person.x && robot.pos.y + (ymax-BOARD_ROWS)/2 + BOARD_ROWS/2 == person.y){
             player.score += 1;
+            TRACE_EVENT(TRACE_RESCUE, robot.pos.x, robot.pos.y, player.score);
             mvprintw(person.y, person.x, " "); // Replace the person with an empty character
             random_coordinates_person(mine_count, mines, &person, &robot);
-            spawn_person(&person);
+            spawn_person(&person, &fov);
             refresh();
         }
+        TRACE_END(PHASE_RESCUE);
+
+        // Send the frame to the spectators
+        TRACE_BEGIN(PHASE_BROADCAST);
+        broadcast_frame(&broadcast, &player, &robot, &person, mines, mine_count, &fov);
+        TRACE_END(PHASE_BROADCAST);
         
         // Delay in microseconds
+        TRACE_BEGIN(PHASE_SLEEP);
         usleep(delay);;
-        WINDOW* board = init_game(player, robot, person, mines, mine_count);
+        TRACE_END(PHASE_SLEEP);
+        TRACE_BEGIN(PHASE_RENDER);
+        clear_board(board); // Reuse the same window every tick
+        update_UI(player, robot, person, mines, mine_count);
+        TRACE_END(PHASE_RENDER);
+        TRACE_END(PHASE_TICK);
+        AUDIT_TICK_END();
     }
+    AUDIT_PHASE(AUDIT_GAME_OVER);
 
     // Wait for user input before exiting
+    update_player_stats(&player); // Add this game to the player's statistics
     save_score(&player); // Save the score of the player to leaderboard.txt    
 
     nodelay(stdscr, FALSE);
     clear(); 
     refresh();
-    game_over_screen(&player, &leaderboard);//Display the exit screen
+    game_over_screen(&player, leaderboard);//Display the exit screen
     //getch();
     //nodelay(stdscr, TRUE);
     free(mines); // Free mines before exiting the program
+    delwin(board);
     
     
     // Cleanup and exit
     endwin();
+    broadcast_stop(&broadcast);
+#ifdef ROBOIO_TRACE
+    if (trace_dump() != 0){
+        fprintf(stderr, "Could not write the trace to %s!\n", TRACE_FILE);
+    }
+#endif
+#ifdef ROBOIO_AUDIT
+    return audit_report();
+#endif
     return 0;
 }
 
@@ -262,6 +558,8 @@ void draw_title_screen(Player *player) {
     player->score = 0;
     player->lives = 3;
     player->level = 0;
+    player->deaths_wall = 0;
+    player->deaths_mine = 0;
 
     attrset(COLOR_PAIR(2));
     mvprintw((ymax-BOARD_ROWS)/2 + 7,(xmax-BOARD_ROWS)/2 - 15, "Welcome to the game agent %s.\n", player->name);
@@ -353,6 +651,14 @@ WINDOW* init_game(Player player, Robot robot, Position person, Position *mines,
     return board;
 }
 
+void clear_board(WINDOW *board){
+    // Wipe the board and redraw its border for the next frame
+    werase(board);
+    box(board, 0, 0);
+    refresh();
+    wrefresh(board);
+}
+
 void update_UI(Player player, Robot robot, Position person, Position *mines, int mine_count) {
     int xmax, ymax;
     getmaxyx(stdscr, ymax, xmax);
@@ -367,24 +673,28 @@ void update_UI(Player player, Robot robot, Position person, Position *mines, int
     wrefresh(stdscr);
 }
 
-void handle_input(Robot *robot, int input, Position *person, Position *mines, int mine_count, WINDOW *board) {
+void handle_input(Robot *robot, int input, Position *person, Position *mines, int mine_count, WINDOW *board, FieldOfView *fov) {
     switch(input) {
         // Change the direction of the robot according to the key pressed by the user
         case KEY_UP:
             robot -> direction = 'N';
+            TRACE_EVENT(TRACE_DIRECTION, robot->pos.x, robot->pos.y, 'N');
             break;
         case KEY_DOWN:
             robot -> direction = 'S';
+            TRACE_EVENT(TRACE_DIRECTION, robot->pos.x, robot->pos.y, 'S');
             break;
         case KEY_LEFT:
             robot -> direction = 'W';
+            TRACE_EVENT(TRACE_DIRECTION, robot->pos.x, robot->pos.y, 'W');
             break;
         case KEY_RIGHT:
             robot -> direction = 'E';
+            TRACE_EVENT(TRACE_DIRECTION, robot->pos.x, robot->pos.y, 'E');
             break;
         default:
             // Auto movement if no key pressed
-            move_robot_ai(robot, person, mines, mine_count);
+            move_robot_ai(robot, person, mines, mine_count, fov);
     }
 }
 
@@ -406,10 +716,11 @@ void move_robot(Robot *robot, Position *person) {
     }
 }
 
-void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_count) {
+void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_count, FieldOfView *fov) {
     // Target for the robot to reach
     int x_target = person -> x;
     int y_target = person -> y;
+    int target_known = fov_can_see(fov, x_target, y_target); // In fog of war the person may be out of sight
     int new_distance, new_x, new_y, xmax, ymax, i, j;
     int flag_mines = 0;
     char flag_direction = '\0'; // To store the direction that leads to the person
@@ -446,16 +757,24 @@ void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_cou
         new_y = robot -> pos.y + possible_movement[i][1];
         // Check if the movement leads to a wall crash
         if (new_x != BOARD_COLS/2 && new_x != -BOARD_COLS/2 && new_y != BOARD_ROWS/2 && new_y != -BOARD_ROWS/2){ 
-            for (j = 0; j < mine_count; j++){
-                // Check if the movement leads to collision with a mine
-                if (new_x + BOARD_COLS/2 + (xmax-BOARD_COLS)/2 == mines[j].x && new_y + BOARD_ROWS/2 + (ymax-BOARD_ROWS)/2 == mines[j].y){ 
-                    flag_mines = 1; // Movement is unsafe
-                } 
-            }    
+            if (fov->enabled){
+                flag_mines = fov_visible_mine(fov, new_x + BOARD_COLS/2, new_y + BOARD_ROWS/2); // Only mines in sight are known
+            } else {
+                for (j = 0; j < mine_count; j++){
+                    // Check if the movement leads to collision with a mine
+                    if (new_x + BOARD_COLS/2 + (xmax-BOARD_COLS)/2 == mines[j].x && new_y + BOARD_ROWS/2 + (ymax-BOARD_ROWS)/2 == mines[j].y){ 
+                        flag_mines = 1; // Movement is unsafe
+                    } 
+                }    
+            }
 
             // If mines are not detected and the robot is not moving back and forth
             if (flag_mines == 0 && possible_directions[i] != previous_opposite_direction){
-                new_distance = absolute_distance(new_x, new_y, x_target, y_target, xmax, ymax);
+                if (target_known){
+                    new_distance = absolute_distance(new_x, new_y, x_target, y_target, xmax, ymax);
+                } else {
+                    new_distance = rand() % 4 + ((possible_directions[i] == robot->direction) ? 0 : 2); // Explore: mostly keep going straight, sometimes turn
+                }
                 // Check if the new distance is smaller than the old distance
                 if (new_distance < distance){ 
                     distance = new_distance; // Change old distance to the new distance
@@ -469,6 +788,9 @@ void move_robot_ai(Robot *robot, Position *person, Position *mines, int mine_cou
     if (flag_direction == '\0'){
         mvwprintw(stdscr, 14, 11 + 5 + (xmax - BOARD_COLS)/2, "No valid move. Staying in place.\n");
         flag_direction = robot -> direction;
+        TRACE_EVENT(TRACE_AI_FALLBACK, robot->pos.x, robot->pos.y, flag_direction);
+    } else {
+        TRACE_EVENT(TRACE_AI_DECISION, robot->pos.x, robot->pos.y, flag_direction);
     }
     robot -> direction = flag_direction; // Change direction of the robot accordingly
 }
@@ -519,7 +841,6 @@ void draw_robot(Robot *robot, WINDOW* board) {
 int check_collision(Robot *robot, Position *mines, int mine_count) {
     int ymax, xmax;
     getmaxyx(stdscr, ymax, xmax);
-    srand(time(NULL));
     if (robot->pos.x == BOARD_COLS/2 || robot->pos.x == -BOARD_COLS/2 || robot->pos.y == BOARD_ROWS/2 || robot->pos.y == -BOARD_ROWS/2){ 
         return 1; // Collision with wall
     } 
@@ -533,14 +854,20 @@ int check_collision(Robot *robot, Position *mines, int mine_count) {
     return 0;
 }
 
-void spawn_person(Position *person) {
+void spawn_person(Position *person, FieldOfView *fov) {
+    if (!fov_can_see(fov, person->x, person->y)){
+        return; // Hidden by the fog of war
+    }
     attrset(COLOR_PAIR(4)); // Apply colours
     mvaddch(person->y, person->x, PERSON); // Print person on the screen
     attroff(COLOR_PAIR(4));
 }
 
-void spawn_mines(Position *mines, int *mine_count) {
+void spawn_mines(Position *mines, int *mine_count, FieldOfView *fov) {
     for (int i = 0; i < *mine_count; i++){
+        if (!fov_can_see(fov, mines[i].x, mines[i].y)){
+            continue; // Hidden by the fog of war
+        }
         attrset(COLOR_PAIR(3)); // apply colors
         mvaddch(mines[i].y, mines[i].x, MINE); //print mines
         attroff(COLOR_PAIR(3));
@@ -569,6 +896,7 @@ void game_over_screen(Player *player, Leaderboard *leaderboard) {
     mvaddstr((ymax-BOARD_ROWS)/2 + 5, (xmax-BOARD_ROWS)/2 - 10, "Here's the leaderboard:\n");
     
     show_leaderboard(leaderboard);
+    show_player_stats(player);
     
     mvaddstr((ymax-BOARD_ROWS)/2+3, (xmax-BOARD_ROWS)/2 - 10, "Press any key to exit...\n");
     attroff(COLOR_PAIR(6));
@@ -594,18 +922,7 @@ void save_score(Player *player) {
 void show_leaderboard(Leaderboard *leaderboard) {
     int xmax, ymax;
     getmaxyx(stdscr, ymax, xmax);
-    int num = 20; // Number of player details to be stored
-    int count = 0; // Keep track of the number of players
-    leaderboard = (Leaderboard *)malloc(num * sizeof(Leaderboard));
-
-    if (leaderboard == NULL){
-        printw("Memory Allocation Failes!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for (int i = 0; i < num; i++){
-        leaderboard[i].score = 0;
-    }
+    int count = 0; // Keep track of the number of players on the leaderboard
 
     FILE *file_pointer;
     file_pointer = fopen("leaderboard.txt", "r");
@@ -616,37 +933,22 @@ void show_leaderboard(Leaderboard *leaderboard) {
     }
 
     char line[256]; // Buffer to store the string from a line
+    char name[MAX_NAME];
     while (fgets(line, sizeof(line), file_pointer)){
-        strncpy(leaderboard[count].name, line, sizeof(leaderboard[count].name)-1); // Store players name to the array of leaderboard structures
-        leaderboard[count].name[sizeof(leaderboard[count].name) - 1] = '\0'; // Add a null character in the end to terminate string.
+        line[strcspn(line, "\n")] = '\0'; // Remove the newline read by fgets
+        strncpy(name, line, sizeof(name)-1); // Store players name
+        name[sizeof(name) - 1] = '\0'; // Add a null character in the end to terminate string.
 
         if (fgets(line, sizeof(line), file_pointer)){ // Next line
-            leaderboard[count].score = atoi(line); // Convert string to integer 
+            // Only the top players are kept, so the whole file never has to be held in memory
+            insert_leaderboard(leaderboard, &count, name, atoi(line));
         } else {
             printw("Player's score mising\n");
             break;
         }
-
-        count++;
-
-        //if memory is full, reallocate memory
-        if (count == num){
-            num += num; // Increase the quantity
-            leaderboard = (Leaderboard *)realloc(leaderboard, num*sizeof(Leaderboard)); // Reallocate memory
-            if (leaderboard == NULL){
-                printw("Memory Allocation Failed!\n");
-                exit(EXIT_FAILURE); // Exit if memory allocation failed
-            }
-            for (int i = 0; i < num; i++){
-                leaderboard[i].score = 0;
-            }
-        }
     }
     fclose(file_pointer);
 
-    //Sorting the scores using bubble sort algorithm
-    sort_leaderboard(leaderboard, num);
-
     // Print top 10
     attrset(COLOR_PAIR(5));
     mvprintw((ymax-BOARD_ROWS)/2 + 7, (xmax-BOARD_ROWS)/2 - 10, "| Position |");
@@ -654,28 +956,18 @@ void show_leaderboard(Leaderboard *leaderboard) {
     mvprintw((ymax-BOARD_ROWS)/2 + 7, (xmax-BOARD_ROWS)/2 + 26, "| Score |");
     attroff(COLOR_PAIR(5));
 
-
-    if (num > 10){
-        for (int i = 0; i < 10; i++){
-            mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 - 5, "%d", i+1);
-            mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 + 5, "%s", leaderboard[i].name);
-            mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 + 31, "%d", leaderboard[i].score);
-        }
-    } else {
-        for (int i = 0; i < num; i++){
-            printw("%d. ", i + 1);
-            printw("%s %d\n", leaderboard[i].name,leaderboard[i].score);
-        }
+    for (int i = 0; i < count; i++){
+        mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 - 5, "%d", i+1);
+        mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 + 5, "%s", leaderboard[i].name);
+        mvprintw((ymax-BOARD_ROWS)/2 + 8+i, (xmax-BOARD_ROWS)/2 + 31, "%d", leaderboard[i].score);
     }
 
     wrefresh(stdscr);
-    free(leaderboard);
 }
 
 void random_coordinates_mines(int mine_count, Position *mines, Position *person, Robot *robot){
     int ymax, xmax;
     getmaxyx(stdscr, ymax, xmax);
-    srand(time(NULL));
     for (int i = 0; i < mine_count; i++){
         do{
             mines[i].x = (xmax-BOARD_COLS)/2 + 3 + rand() % (BOARD_COLS - 4); //Random x position within walls
@@ -688,7 +980,6 @@ void random_coordinates_person(int mine_count, Position *mines, Position *person
     int ymax, xmax;
     getmaxyx(stdscr, ymax, xmax);
     int flag1, flag2 = 0;
-    srand(time(NULL));
 
     while (flag2 == 0){
         person->x = (xmax-BOARD_COLS)/2 + 2 + rand() % (BOARD_COLS-4); //Random x position within walls
@@ -712,23 +1003,295 @@ void random_coordinates_person(int mine_count, Position *mines, Position *person
     }
 }
 
-void sort_leaderboard(Leaderboard *leaderboard, int num){
-    // Bubble sort the leaderboard array
-    char temp_name[MAX_NAME];
-    int temp_score;
-    for (int i = 0; i < num; i++){
-        for (int j = 0; j < num - i - 1; j++){
-            if (leaderboard[j].score < leaderboard[j+1].score){
-                // Swap names and scores
-                strcpy(temp_name,leaderboard[j].name);
-                temp_score = leaderboard[j].score;
-                strcpy(leaderboard[j].name,leaderboard[j+1].name);
-                leaderboard[j].score = leaderboard[j+1].score;
-                strcpy(leaderboard[j+1].name,temp_name);
-                leaderboard[j+1].score = temp_score;
+void insert_leaderboard(Leaderboard *leaderboard, int *count, const char *name, int score){
+    // Insert a score into the leaderboard, which is kept sorted with at most LEADERBOARD_SIZE players
+    int i = *count;
+    if (i == LEADERBOARD_SIZE){
+        if (score <= leaderboard[i-1].score){
+            return; // Not good enough for the leaderboard
+        }
+        i--; // Drop the lowest score
+    } else {
+        *count += 1;
+    }
+
+    // Shift lower scores down to make room
+    while (i > 0 && leaderboard[i-1].score < score){
+        leaderboard[i] = leaderboard[i-1];
+        i--;
+    }
+    strcpy(leaderboard[i].name, name);
+    leaderboard[i].score = score;
+}
+
+static unsigned int stats_hash(const char *name){
+    // FNV-1a hash of the player's name
+    unsigned int hash = 2166136261u;
+    for (int i = 0; name[i] != '\0'; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static long stats_slot_offset(int slot){
+    return (long)sizeof(StatsHeader) + (long)slot * (long)sizeof(PlayerStats);
+}
+
+static int stats_find_slot(FILE *file_pointer, StatsHeader *header, const char *name, PlayerStats *stats){
+    // Linear probing from the name's hash until the player or an empty slot is found
+    int slot = stats_hash(name) % header->capacity;
+    for (int i = 0; i < header->capacity; i++){
+        fseek(file_pointer, stats_slot_offset(slot), SEEK_SET);
+        if (fread(stats, sizeof(PlayerStats), 1, file_pointer) != 1){
+            return -1;
+        }
+        if (stats->games_played == 0 || strncmp(stats->name, name, MAX_NAME) == 0){
+            return slot;
+        }
+        slot = (slot + 1) % header->capacity;
+    }
+    return -1; // Table is full
+}
+
+static FILE *stats_create(const char *path, StatsHeader *header, int capacity){
+    // Write a header and 'capacity' empty slots
+    FILE *file_pointer = fopen(path, "w+b");
+    if (file_pointer == NULL){
+        return NULL;
+    }
+
+    PlayerStats empty;
+    memset(&empty, 0, sizeof(empty));
+    memcpy(header->magic, STATS_MAGIC, 8);
+    header->capacity = capacity;
+    header->count = 0;
+    fwrite(header, sizeof(StatsHeader), 1, file_pointer);
+    for (int i = 0; i < capacity; i++){
+        fwrite(&empty, sizeof(empty), 1, file_pointer);
+    }
+    return file_pointer;
+}
+
+static FILE *stats_grow(FILE *file_pointer, StatsHeader *header){
+    // Rehash every player into a file twice the size and replace the old one
+    StatsHeader new_header;
+    memset(&new_header, 0, sizeof(new_header));
+    FILE *new_file = stats_create(STATS_FILE ".tmp", &new_header, header->capacity * 2);
+    if (new_file == NULL){
+        return file_pointer;
+    }
+    memcpy(new_header.most_improved, header->most_improved, sizeof(header->most_improved));
+
+    PlayerStats stats, found;
+    for (int i = 0; i < header->capacity; i++){
+        fseek(file_pointer, stats_slot_offset(i), SEEK_SET);
+        if (fread(&stats, sizeof(stats), 1, file_pointer) != 1){
+            break;
+        }
+        if (stats.games_played != 0){
+            int slot = stats_find_slot(new_file, &new_header, stats.name, &found);
+            if (slot < 0){
+                // Keep the old file rather than replace it with a partial copy
+                fclose(new_file);
+                remove(STATS_FILE ".tmp");
+                return file_pointer;
             }
+            fseek(new_file, stats_slot_offset(slot), SEEK_SET);
+            fwrite(&stats, sizeof(stats), 1, new_file);
+            new_header.count++;
+        }
+    }
+    fseek(new_file, 0, SEEK_SET);
+    fwrite(&new_header, sizeof(new_header), 1, new_file);
+    fclose(file_pointer);
+    fclose(new_file);
+
+#ifdef _WIN32
+    remove(STATS_FILE); // rename does not replace an existing file on Windows
+#endif
+    if (rename(STATS_FILE ".tmp", STATS_FILE) != 0){
+        remove(STATS_FILE ".tmp");
+    } else {
+        *header = new_header;
+    }
+    return fopen(STATS_FILE, "r+b");
+}
+
+static void stats_update_most_improved(StatsHeader *header, PlayerStats *stats){
+    // A player's improvement never goes down, so the board only needs this player's new value
+    ImprovedEntry *board = header->most_improved;
+    int improvement = stats->best_score - stats->first_score;
+    int i;
+
+    if (improvement <= 0){
+        return;
+    }
+
+    // Take the player off the board if they are already on it
+    for (i = 0; i < MOST_IMPROVED; i++){
+        if (board[i].improvement > 0 && strncmp(board[i].name, stats->name, MAX_NAME) == 0){
+            memmove(&board[i], &board[i+1], (MOST_IMPROVED - i - 1) * sizeof(ImprovedEntry));
+            memset(&board[MOST_IMPROVED - 1], 0, sizeof(ImprovedEntry));
+            break;
+        }
+    }
+
+    // Insert them at their sorted position
+    for (i = 0; i < MOST_IMPROVED; i++){
+        if (improvement > board[i].improvement){
+            memmove(&board[i+1], &board[i], (MOST_IMPROVED - i - 1) * sizeof(ImprovedEntry));
+            memcpy(board[i].name, stats->name, MAX_NAME);
+            board[i].improvement = improvement;
+            break;
+        }
+    }
+}
+
+static int stats_add_game(FILE **file_pointer, StatsHeader *header, const char *name, int score, int level, int deaths_wall, int deaths_mine){
+    // Add one game to a player's record, the caller writes the header back afterwards
+    PlayerStats stats;
+
+    // Keep the table at most 3/4 full so probing stays short
+    if ((header->count + 1) * 4 > header->capacity * 3){
+        *file_pointer = stats_grow(*file_pointer, header);
+        if (*file_pointer == NULL){
+            return -1;
+        }
+    }
+
+    int slot = stats_find_slot(*file_pointer, header, name, &stats);
+    if (slot < 0){
+        return -1;
+    }
+
+    if (stats.games_played == 0){
+        // First game of this player
+        memset(&stats, 0, sizeof(stats));
+        snprintf(stats.name, sizeof(stats.name), "%s", name);
+        stats.first_score = score;
+        header->count++;
+    }
+    stats.games_played += 1;
+    stats.total_rescued += score;
+    stats.deaths_wall += deaths_wall;
+    stats.deaths_mine += deaths_mine;
+    if (score > stats.best_score){
+        stats.best_score = score;
+    }
+    if (level > stats.highest_level){
+        stats.highest_level = level;
+    }
+    stats_update_most_improved(header, &stats);
+
+    // Only the player's slot is written back
+    fseek(*file_pointer, stats_slot_offset(slot), SEEK_SET);
+    fwrite(&stats, sizeof(stats), 1, *file_pointer);
+    return 0;
+}
+
+static void stats_import_leaderboard(FILE **file_pointer, StatsHeader *header){
+    // Build the records of a new stats file from the games already in leaderboard.txt
+    // The leaderboard only has names and scores, so deaths start at zero and the level is worked out from the score
+    FILE *leaderboard_file = fopen("leaderboard.txt", "r");
+    if (leaderboard_file == NULL){
+        return; // No games played yet
+    }
+
+    char line[256];
+    char name[MAX_NAME];
+    while (*file_pointer != NULL && fgets(line, sizeof(line), leaderboard_file)){
+        line[strcspn(line, "\n")] = '\0';
+        line[MAX_NAME - 1] = '\0'; // Names are cut to the same length as in the game
+        memcpy(name, line, MAX_NAME);
+        if (!fgets(line, sizeof(line), leaderboard_file)){
+            break;
+        }
+        int score = atoi(line);
+        if (stats_add_game(file_pointer, header, name, score, score / 5 + 1, 0, 0) != 0){
+            break;
+        }
+    }
+    fclose(leaderboard_file);
+}
+
+void update_player_stats(Player *player){
+    // Must run before save_score so that a new stats file imports the history without this game
+    StatsHeader header;
+    FILE *file_pointer = fopen(STATS_FILE, "r+b");
+
+    if (file_pointer == NULL){
+        memset(&header, 0, sizeof(header));
+        file_pointer = stats_create(STATS_FILE, &header, STATS_INITIAL_CAPACITY);
+        if (file_pointer != NULL){
+            stats_import_leaderboard(&file_pointer, &header);
         }
+        if (file_pointer == NULL){
+            printw("Error accessing the player statistics file!\n");
+            return;
+        }
+    } else if (fread(&header, sizeof(header), 1, file_pointer) != 1 || memcmp(header.magic, STATS_MAGIC, 8) != 0){
+        fclose(file_pointer);
+        printw("Player statistics file is corrupted!\n");
+        return;
+    }
+
+    if (stats_add_game(&file_pointer, &header, player->name, player->score, player->level + 1, player->deaths_wall, player->deaths_mine) != 0){
+        printw("Error updating the player statistics!\n");
+    }
+    if (file_pointer == NULL){
+        return;
+    }
+
+    fseek(file_pointer, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file_pointer);
+    fclose(file_pointer);
+}
+
+int load_player_stats(const char *name, PlayerStats *stats, StatsHeader *header){
+    // Look up a player's statistics and read the file header, returns 0 if the player has never played
+    FILE *file_pointer = fopen(STATS_FILE, "rb");
+    if (file_pointer == NULL){
+        return 0;
     }
+
+    int found = 0;
+    if (fread(header, sizeof(StatsHeader), 1, file_pointer) == 1 && memcmp(header->magic, STATS_MAGIC, 8) == 0){
+        int slot = stats_find_slot(file_pointer, header, name, stats);
+        found = slot >= 0 && stats->games_played != 0;
+    }
+    fclose(file_pointer);
+    return found;
+}
+
+void show_player_stats(Player *player){
+    int xmax, ymax;
+    getmaxyx(stdscr, ymax, xmax);
+    int row = (ymax-BOARD_ROWS)/2 + 5;
+    int col = (xmax-BOARD_ROWS)/2 + 45;
+    PlayerStats stats;
+    StatsHeader header;
+
+    if (!load_player_stats(player->name, &stats, &header)){
+        return;
+    }
+
+    // Player profile
+    mvprintw(row, col, "%s's record:", stats.name);
+    mvprintw(row + 2, col, "Games played:    %d", stats.games_played);
+    mvprintw(row + 3, col, "Best score:      %d", stats.best_score);
+    mvprintw(row + 4, col, "Average score:   %.1f", (double)stats.total_rescued / stats.games_played);
+    mvprintw(row + 5, col, "Highest level:   %d", stats.highest_level);
+    mvprintw(row + 6, col, "People rescued:  %d", stats.total_rescued);
+    mvprintw(row + 7, col, "Wall crashes:    %d", stats.deaths_wall);
+    mvprintw(row + 8, col, "Mines hit:       %d", stats.deaths_mine);
+
+    // Most improved board, kept in the header of the stats file
+    mvprintw(row + 10, col, "Most improved:");
+    for (int i = 0; i < MOST_IMPROVED && header.most_improved[i].improvement > 0; i++){
+        mvprintw(row + 11 + i, col, "%d. %-*s +%d", i + 1, MAX_NAME, header.most_improved[i].name, header.most_improved[i].improvement);
+    }
+    wrefresh(stdscr);
 }
 
 int absolute_distance(int robot_x, int robot_y, int person_x, int person_y, int xmax, int ymax){
@@ -768,3 +1331,894 @@ void draw_soldier(int xmax, int ymax){
     attroff(COLOR_PAIR(2));
     wrefresh(stdscr);
 }
+
+static int fov_floor_div(int a, int b){
+    // Division rounding towards negative infinity (b > 0)
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static int fov_inside(int x, int y){
+    // Check if a board position is inside the walls
+    return x > 0 && x < BOARD_COLS - 1 && y > 0 && y < BOARD_ROWS - 1;
+}
+
+static int fov_cell_opaque(FieldOfView *fov, int x, int y){
+    // The walls block the sensor like mines do
+    if (!fov_inside(x, y)){
+        return 1;
+    }
+    return FOV_TEST(fov->opaque, x, y);
+}
+
+static void fov_reveal(FieldOfView *fov, int x, int y){
+    int dx = x - fov->origin_x;
+    int dy = y - fov->origin_y;
+    if (fov_inside(x, y) && dx*dx + dy*dy <= FOV_RADIUS*FOV_RADIUS){
+        FOV_SET(fov->visible, x, y);
+    }
+}
+
+static void fov_quadrant_cell(FieldOfView *fov, int quadrant, int depth, int col, int *x, int *y){
+    // Turn (depth, col) in a quadrant into board coordinates
+    switch (quadrant){
+        case 0: *x = fov->origin_x + col; *y = fov->origin_y - depth; break; // North
+        case 1: *x = fov->origin_x + depth; *y = fov->origin_y + col; break; // East
+        case 2: *x = fov->origin_x + col; *y = fov->origin_y + depth; break; // South
+        default: *x = fov->origin_x - depth; *y = fov->origin_y + col; break; // West
+    }
+}
+
+static void fov_scan(FieldOfView *fov, int quadrant, int depth, int start_num, int start_den, int end_num, int end_den){
+    // Symmetric shadowcasting of one row of a quadrant, slopes are the fractions start_num/start_den and end_num/end_den
+    if (depth > FOV_RADIUS){
+        return;
+    }
+
+    int min_col = fov_floor_div(2*depth*start_num + start_den, 2*start_den); // Round ties up
+    int max_col = -fov_floor_div(-(2*depth*end_num - end_den), 2*end_den); // Round ties down
+    int previous = -1; // -1 before the first cell, then 1 for opaque and 0 for clear
+    int x, y;
+
+    for (int col = min_col; col <= max_col; col++){
+        fov_quadrant_cell(fov, quadrant, depth, col, &x, &y);
+        int opaque = fov_cell_opaque(fov, x, y);
+
+        // Opaque cells are seen whenever lit, clear cells only when the view is symmetric
+        if (opaque || (col * start_den >= depth * start_num && col * end_den <= depth * end_num)){
+            fov_reveal(fov, x, y);
+        }
+        if (previous == 1 && !opaque){
+            start_num = 2*col - 1; // The previous opaque cell ends a shadow
+            start_den = 2*depth;
+        }
+        if (previous == 0 && opaque){
+            fov_scan(fov, quadrant, depth + 1, start_num, start_den, 2*col - 1, 2*depth); // The clear part before this cell continues
+        }
+        previous = opaque;
+    }
+    if (previous == 0){
+        fov_scan(fov, quadrant, depth + 1, start_num, start_den, end_num, end_den);
+    }
+}
+
+void fov_set_mines(FieldOfView *fov, Position *mines, int mine_count){
+    // Mines block the sensor, rebuild the opaque cells whenever they move
+    int ymax, xmax;
+    getmaxyx(stdscr, ymax, xmax);
+
+    memset(fov->opaque, 0, sizeof(fov->opaque));
+    for (int i = 0; i < mine_count; i++){
+        int x = mines[i].x - (xmax-BOARD_COLS)/2;
+        int y = mines[i].y - (ymax-BOARD_ROWS)/2;
+        if (fov_inside(x, y)){
+            FOV_SET(fov->opaque, x, y);
+        }
+    }
+    fov->dirty = 1;
+}
+
+void fov_update(FieldOfView *fov, Robot *robot){
+    // Recompute what the robot can see, only when it moved to a new cell or the mines changed
+    if (!fov->enabled){
+        return;
+    }
+
+    int x = robot->pos.x + BOARD_COLS/2;
+    int y = robot->pos.y + BOARD_ROWS/2;
+    if (!fov->dirty && x == fov->origin_x && y == fov->origin_y){
+        return;
+    }
+
+    uint64_t previous[BOARD_ROWS][FOV_WORDS];
+    memcpy(previous, fov->visible, sizeof(previous));
+    memset(fov->visible, 0, sizeof(fov->visible));
+    fov->origin_x = x;
+    fov->origin_y = y;
+    fov->dirty = 0;
+
+    fov_reveal(fov, x, y);
+    for (int quadrant = 0; quadrant < 4; quadrant++){
+        fov_scan(fov, quadrant, 1, -1, 1, 1, 1);
+    }
+
+    // Erase every cell that just went out of sight, cells coming into sight are drawn by spawn_mines and spawn_person
+    int ymax, xmax;
+    getmaxyx(stdscr, ymax, xmax);
+    for (int row = 0; row < BOARD_ROWS; row++){
+        for (int word = 0; word < FOV_WORDS; word++){
+            uint64_t hidden = previous[row][word] & ~fov->visible[row][word];
+            while (hidden != 0){
+                int bit = __builtin_ctzll(hidden);
+                mvaddch((ymax-BOARD_ROWS)/2 + row, (xmax-BOARD_COLS)/2 + word*64 + bit, ' ');
+                hidden &= hidden - 1;
+            }
+        }
+    }
+}
+
+int fov_can_see(FieldOfView *fov, int screen_x, int screen_y){
+    // Check whether the robot can see a screen position, everything is visible when fog of war is off
+    int ymax, xmax;
+    if (!fov->enabled){
+        return 1;
+    }
+    getmaxyx(stdscr, ymax, xmax);
+    int x = screen_x - (xmax-BOARD_COLS)/2;
+    int y = screen_y - (ymax-BOARD_ROWS)/2;
+    if (!fov_inside(x, y)){
+        return 0;
+    }
+    return FOV_TEST(fov->visible, x, y);
+}
+
+int fov_visible_mine(FieldOfView *fov, int x, int y){
+    // Check for a mine the robot can see at a board position
+    if (!fov_inside(x, y)){
+        return 0;
+    }
+    return FOV_TEST(fov->opaque, x, y) && FOV_TEST(fov->visible, x, y);
+}
+
+#ifndef _WIN32
+static void broadcast_accept(Broadcast *broadcast){
+    // Pick up spectators waiting to connect, they get a keyframe on the next frame
+    int fd;
+    while ((fd = accept(broadcast->listen_fd, NULL, NULL)) >= 0){
+        if (broadcast->spectator_count == MAX_SPECTATORS){
+            // Too many spectators, tell this one why it is being disconnected
+            FrameHeader refused;
+            memset(&refused, 0, sizeof(refused));
+            refused.type = FRAME_REFUSED;
+            refused.update_count = MAX_SPECTATORS; // Lets the spectator report the limit
+            send(fd, &refused, sizeof(refused), 0); // The spectator sees the connection close even if this fails
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); // A slow spectator must never block the game
+        broadcast->spectators[broadcast->spectator_count] = fd;
+        broadcast->synced[broadcast->spectator_count] = 0;
+        broadcast->spectator_count++;
+        broadcast->force_keyframe = 1;
+    }
+}
+
+static void broadcast_drop(Broadcast *broadcast, int i){
+    // Disconnect a spectator by moving the last one into its place
+    close(broadcast->spectators[i]);
+    broadcast->spectator_count--;
+    broadcast->spectators[i] = broadcast->spectators[broadcast->spectator_count];
+    broadcast->synced[i] = broadcast->synced[broadcast->spectator_count];
+}
+
+static void broadcast_set_cell(Broadcast *broadcast, int x, int y, char ch, int color){
+    if (x >= 0 && x < BOARD_COLS && y >= 0 && y < BOARD_ROWS){
+        broadcast->current[y][x].ch = (unsigned char)ch;
+        broadcast->current[y][x].color = (unsigned char)color;
+    }
+}
+
+int broadcast_start(Broadcast *broadcast, const char *path){
+    struct sockaddr_un address;
+    struct stat info;
+
+    signal(SIGPIPE, SIG_IGN); // Spectators closing their connection must not kill the game
+    broadcast->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (broadcast->listen_fd < 0){
+        fprintf(stderr, "Cannot create the broadcast socket!\n");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    snprintf(broadcast->path, sizeof(broadcast->path), "%s", address.sun_path);
+
+    // Only remove a socket left by a previous game, never a file or a game still running
+    if (lstat(address.sun_path, &info) == 0){
+        if (!S_ISSOCK(info.st_mode)){
+            fprintf(stderr, "Cannot broadcast on %s, it exists and is not a socket!\n", address.sun_path);
+            close(broadcast->listen_fd);
+            broadcast->listen_fd = -1;
+            return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int listening = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        int stale = !listening && errno == ECONNREFUSED;
+        if (probe >= 0){
+            close(probe);
+        }
+        if (listening){
+            fprintf(stderr, "A game is already broadcasting on %s!\n", address.sun_path);
+            close(broadcast->listen_fd);
+            broadcast->listen_fd = -1;
+            return -1;
+        }
+        if (stale){
+            unlink(address.sun_path);
+        }
+    }
+
+    if (bind(broadcast->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(broadcast->listen_fd, MAX_SPECTATORS) != 0){
+        fprintf(stderr, "Cannot broadcast on %s!\n", address.sun_path);
+        close(broadcast->listen_fd);
+        broadcast->listen_fd = -1;
+        return -1;
+    }
+    fcntl(broadcast->listen_fd, F_SETFL, fcntl(broadcast->listen_fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+void broadcast_frame(Broadcast *broadcast, Player *player, Robot *robot, Position *person, Position *mines, int mine_count, FieldOfView *fov){
+    if (broadcast->listen_fd < 0){
+        return;
+    }
+
+    broadcast_accept(broadcast);
+    broadcast->frame++;
+    if (broadcast->spectator_count == 0){
+        return; // Nobody is watching, new spectators get a keyframe anyway
+    }
+
+    int ymax, xmax;
+    getmaxyx(stdscr, ymax, xmax);
+
+    // Build the board as the spectators should see it
+    memset(broadcast->current, 0, sizeof(broadcast->current));
+    for (int i = 0; i < mine_count; i++){
+        if (fov_can_see(fov, mines[i].x, mines[i].y)){
+            broadcast_set_cell(broadcast, mines[i].x - (xmax-BOARD_COLS)/2, mines[i].y - (ymax-BOARD_ROWS)/2, MINE, 3);
+        }
+    }
+    if (fov_can_see(fov, person->x, person->y)){
+        broadcast_set_cell(broadcast, person->x - (xmax-BOARD_COLS)/2, person->y - (ymax-BOARD_ROWS)/2, PERSON, 4);
+    }
+    int x = robot->pos.x + BOARD_COLS/2;
+    int y = robot->pos.y + BOARD_ROWS/2;
+    switch (robot->direction){
+        case 'N': broadcast_set_cell(broadcast, x, y - 1, '^', 2); break;
+        case 'S': broadcast_set_cell(broadcast, x, y + 1, 'v', 2); break;
+        case 'E': broadcast_set_cell(broadcast, x + 1, y, '>', 2); break;
+        case 'W': broadcast_set_cell(broadcast, x - 1, y, '<', 2); break;
+    }
+    broadcast_set_cell(broadcast, x, y, ROBOT_BODY[0], 1);
+
+    // Encode the frame: every non-empty cell for a keyframe, otherwise only the cells that changed
+    int keyframe = broadcast->force_keyframe || broadcast->frame % KEYFRAME_INTERVAL == 0;
+    FrameHeader *header = (FrameHeader *)broadcast->packet;
+    FrameUpdate *updates = (FrameUpdate *)(broadcast->packet + sizeof(FrameHeader));
+    int count = 0;
+    for (int row = 0; row < BOARD_ROWS; row++){
+        for (int col = 0; col < BOARD_COLS; col++){
+            FrameCell cell = broadcast->current[row][col];
+            FrameCell old = broadcast->previous[row][col];
+            if (keyframe ? cell.ch != 0 : (cell.ch != old.ch || cell.color != old.color)){
+                updates[count].x = (uint8_t)col;
+                updates[count].y = (uint8_t)row;
+                updates[count].ch = cell.ch;
+                updates[count].color = cell.color;
+                count++;
+            }
+        }
+    }
+    memcpy(broadcast->previous, broadcast->current, sizeof(broadcast->previous));
+
+    memset(header, 0, sizeof(FrameHeader));
+    header->type = keyframe ? FRAME_KEY : FRAME_DIFF;
+    header->update_count = (uint16_t)count;
+    header->frame = broadcast->frame;
+    header->lives = (int16_t)player->lives;
+    header->score = (int16_t)player->score;
+    header->level = (int16_t)(player->level + 1);
+    memcpy(header->name, player->name, MAX_NAME);
+    header->name[MAX_NAME - 1] = '\0';
+
+    // Send the same bytes to everyone, spectators that joined since the last keyframe wait for the next one
+    size_t length = sizeof(FrameHeader) + count * sizeof(FrameUpdate);
+    for (int i = broadcast->spectator_count - 1; i >= 0; i--){
+        if (!keyframe && !broadcast->synced[i]){
+            continue;
+        }
+        if (send(broadcast->spectators[i], broadcast->packet, length, 0) != (ssize_t)length){
+            broadcast_drop(broadcast, i); // Disconnected or too far behind
+        } else {
+            broadcast->synced[i] = 1;
+        }
+    }
+    broadcast->force_keyframe = 0;
+}
+
+void broadcast_stop(Broadcast *broadcast){
+    if (broadcast->listen_fd < 0){
+        return;
+    }
+    while (broadcast->spectator_count > 0){
+        broadcast_drop(broadcast, broadcast->spectator_count - 1);
+    }
+    close(broadcast->listen_fd);
+    unlink(broadcast->path);
+    broadcast->listen_fd = -1;
+}
+
+static int spectate_read(int fd, void *buffer, size_t length){
+    // Read exactly 'length' bytes, returns 0 when the game has ended
+    size_t done = 0;
+    while (done < length){
+        ssize_t n = read(fd, (char *)buffer + done, length - done);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+static const char *spectate_sgr(int color){
+    // ANSI colours matching the game's colour pairs
+    switch (color){
+        case 1: return "30;42";
+        case 2: return "32;40";
+        case 3: return "30;41";
+        case 4: return "30;43";
+    }
+    return "0";
+}
+
+static chtype spectate_wall(int row, int col){
+    // The character box() draws at a board cell, the robot can drive over these
+    int top = row == 0, bottom = row == BOARD_ROWS - 1, left = col == 0, right = col == BOARD_COLS - 1;
+    if (top || bottom){
+        return left ? (top ? ACS_ULCORNER : ACS_LLCORNER) : right ? (top ? ACS_URCORNER : ACS_LRCORNER) : ACS_HLINE;
+    }
+    return (left || right) ? ACS_VLINE : ' ';
+}
+
+static char spectate_wall_ascii(int row, int col){
+    // The same wall in plain ASCII for recordings
+    int corner = (row == 0 || row == BOARD_ROWS - 1) && (col == 0 || col == BOARD_COLS - 1);
+    return corner ? '+' : (row == 0 || row == BOARD_ROWS - 1) ? '-' : (col == 0 || col == BOARD_COLS - 1) ? '|' : ' ';
+}
+
+static void spectate_record(FILE *record, double seconds, FrameHeader *header, FrameUpdate *updates){
+    // Write the frame as an asciicast v2 output event, using ANSI escapes to draw the changed cells
+    static char output[65536];
+    int length = 0;
+    int i;
+
+    if (header->type == FRAME_KEY){
+        // Clear the terminal and draw the walls
+        length += snprintf(output + length, sizeof(output) - length, "\x1b[0m\x1b[2J");
+        for (int row = 0; row < BOARD_ROWS; row++){
+            length += snprintf(output + length, sizeof(output) - length, "\x1b[%d;1H", row + 2);
+            for (int col = 0; col < BOARD_COLS && length < (int)sizeof(output) - 1; col++){
+                output[length++] = spectate_wall_ascii(row, col);
+            }
+        }
+    }
+    length += snprintf(output + length, sizeof(output) - length, "\x1b[1;1H\x1b[0m\x1b[2KPLAYER: %s  LIVES: %d  SCORE: %d  LEVEL: %d",
+                       header->name, header->lives, header->score, header->level);
+    for (i = 0; i < header->update_count && length < (int)sizeof(output) - 32; i++){
+        if (updates[i].ch != 0){
+            length += snprintf(output + length, sizeof(output) - length, "\x1b[%d;%dH\x1b[%sm%c\x1b[0m", updates[i].y + 2, updates[i].x + 1, spectate_sgr(updates[i].color), updates[i].ch);
+        } else {
+            length += snprintf(output + length, sizeof(output) - length, "\x1b[%d;%dH%c", updates[i].y + 2, updates[i].x + 1, spectate_wall_ascii(updates[i].y, updates[i].x));
+        }
+    }
+
+    // JSON-escape the output
+    fprintf(record, "[%.6f, \"o\", \"", seconds);
+    for (i = 0; i < length; i++){
+        unsigned char c = (unsigned char)output[i];
+        if (c == '"' || c == '\\'){
+            fprintf(record, "\\%c", c);
+        } else if (c < 0x20){
+            fprintf(record, "\\u%04x", c);
+        } else {
+            fputc(c, record);
+        }
+    }
+    fprintf(record, "\"]\n");
+}
+
+int spectate(const char *path, const char *record_path){
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0){
+        fprintf(stderr, "No game is being broadcast on %s!\n", path);
+        if (fd >= 0){
+            close(fd);
+        }
+        return 1;
+    }
+
+    FILE *record = NULL;
+    if (record_path != NULL){
+        record = fopen(record_path, "w");
+        if (record == NULL){
+            fprintf(stderr, "Cannot create %s!\n", record_path);
+            close(fd);
+            return 1;
+        }
+        fprintf(record, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld, \"title\": \"RoboIO\"}\n", BOARD_COLS, BOARD_ROWS + 1, (long)time(NULL));
+    }
+
+    // Same screen setup as the game
+    initscr();
+    cbreak();
+    noecho();
+    start_color();
+    keypad(stdscr, TRUE);
+    curs_set(0);
+    nodelay(stdscr, TRUE);
+    init_pair(1, COLOR_BLACK, COLOR_GREEN);
+    init_pair(2, COLOR_GREEN, COLOR_BLACK);
+    init_pair(3, COLOR_BLACK, COLOR_RED);
+    init_pair(4, COLOR_BLACK, COLOR_YELLOW);
+
+    int ymax, xmax;
+    getmaxyx(stdscr, ymax, xmax);
+    WINDOW *board = newwin(BOARD_ROWS, BOARD_COLS, (ymax-BOARD_ROWS)/2, (xmax-BOARD_COLS)/2);
+    mvaddstr(1, (xmax - BOARD_COLS)/2, "Waiting for the next frame... (press q to stop watching)");
+    refresh();
+
+    static FrameUpdate updates[BOARD_ROWS * BOARD_COLS];
+    FrameHeader header;
+    struct pollfd watch = {.fd = fd, .events = POLLIN};
+    struct timespec start, now;
+    int synced = 0;
+    int refused = 0;
+    int ended = 0; // Set when the game closed the connection
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (getch() != 'q'){
+        if (poll(&watch, 1, 100) <= 0){
+            continue; // Check for q again
+        }
+        if (!spectate_read(fd, &header, sizeof(header))){
+            ended = 1; // The game has ended
+            break;
+        }
+        if (header.type == FRAME_REFUSED){
+            refused = header.update_count;
+            break;
+        }
+        if (header.update_count > BOARD_ROWS * BOARD_COLS || !spectate_read(fd, updates, header.update_count * sizeof(FrameUpdate))){
+            ended = 1;
+            break;
+        }
+
+        if (header.type == FRAME_KEY){
+            werase(board);
+            box(board, 0, 0);
+            synced = 1;
+        }
+        if (!synced){
+            continue;
+        }
+
+        // Draw only the cells in the update
+        for (int i = 0; i < header.update_count; i++){
+            if (updates[i].ch != 0){
+                mvwaddch(board, updates[i].y, updates[i].x, updates[i].ch | COLOR_PAIR(updates[i].color));
+            } else {
+                mvwaddch(board, updates[i].y, updates[i].x, spectate_wall(updates[i].y, updates[i].x));
+            }
+        }
+        header.name[MAX_NAME - 1] = '\0';
+        move(1, 0);
+        clrtoeol();
+        mvprintw(1, (xmax - BOARD_COLS)/2 + 30, "PLAYER: %s  LIVES: %d  SCORE: %d  LEVEL: %d", header.name, header.lives, header.score, header.level);
+        refresh();
+        wrefresh(board);
+
+        if (record != NULL){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            spectate_record(record, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, &header, updates);
+        }
+    }
+
+    delwin(board);
+    endwin();
+    close(fd);
+    if (record != NULL){
+        fclose(record);
+        printf("Recording saved to %s\n", record_path);
+    }
+    if (refused){
+        fprintf(stderr, "The game already has %d spectators, try again later!\n", refused);
+        return 1;
+    }
+    if (ended){
+        printf("The broadcast has ended.\n");
+    }
+    return 0;
+}
+#else
+int broadcast_start(Broadcast *broadcast, const char *path){
+    fprintf(stderr, "Broadcasting needs Unix sockets and is not available on this system!\n");
+    return -1;
+}
+
+void broadcast_frame(Broadcast *broadcast, Player *player, Robot *robot, Position *person, Position *mines, int mine_count, FieldOfView *fov){
+}
+
+void broadcast_stop(Broadcast *broadcast){
+}
+
+int spectate(const char *path, const char *record_path){
+    fprintf(stderr, "Spectating needs Unix sockets and is not available on this system!\n");
+    return 1;
+}
+#endif
+
+#ifdef ROBOIO_TRACE
+// The game runs on a single thread, so one ring buffer is enough and needs no locking
+static TraceEvent trace_buffer[TRACE_CAPACITY];
+static uint64_t trace_total = 0; // Number of records ever written, the newest record is at (trace_total - 1) % TRACE_CAPACITY
+static struct timespec trace_epoch;
+static void (*trace_previous_sigint)(int) = SIG_DFL;
+static void (*trace_previous_sigterm)(int) = SIG_DFL;
+
+static void trace_signal(int sig){
+    // Save the trace when the game is killed (e.g. Ctrl+C on a frozen robot) then let the old handler run
+    if (trace_dump() != 0){
+        static const char message[] = "Could not write the trace!\n";
+        ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1); // Nothing else can be done from a signal handler
+        (void)ignored;
+    }
+    void (*previous)(int) = (sig == SIGINT) ? trace_previous_sigint : trace_previous_sigterm;
+    signal(sig, previous);
+    raise(sig);
+}
+
+void trace_start(void){
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    trace_previous_sigint = signal(SIGINT, trace_signal);
+    trace_previous_sigterm = signal(SIGTERM, trace_signal);
+    if (trace_previous_sigint == SIG_ERR || trace_previous_sigint == SIG_IGN){
+        trace_previous_sigint = SIG_DFL;
+    }
+    if (trace_previous_sigterm == SIG_ERR || trace_previous_sigterm == SIG_IGN){
+        trace_previous_sigterm = SIG_DFL;
+    }
+}
+
+void trace_record(int type, int x, int y, int value){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceEvent *event = &trace_buffer[trace_total % TRACE_CAPACITY]; // Overwrite the oldest record once the buffer is full
+    event->timestamp = (uint64_t)(now.tv_sec - trace_epoch.tv_sec) * 1000000 + (now.tv_nsec - trace_epoch.tv_nsec) / 1000;
+    event->type = (uint16_t)type;
+    event->x = (int16_t)x;
+    event->y = (int16_t)y;
+    event->value = (uint16_t)value;
+    trace_total++;
+}
+
+static int trace_write(int fd, const void *data, size_t length){
+    // Write all of 'length' bytes, returns -1 if the write failed
+    size_t done = 0;
+    while (done < length){
+        ssize_t n = write(fd, (const char *)data + done, length - done);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int trace_dump(void){
+    // Only uses open/write so that it can also be called from the signal handler, returns -1 on failure
+    int fd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return -1;
+    }
+
+    uint64_t count = trace_total < TRACE_CAPACITY ? trace_total : TRACE_CAPACITY;
+    uint64_t first = trace_total - count; // Index of the oldest record still in the buffer
+
+    // Write the records oldest first, in at most two chunks because the buffer wraps around
+    uint64_t start = first % TRACE_CAPACITY;
+    uint64_t chunk = count < TRACE_CAPACITY - start ? count : TRACE_CAPACITY - start;
+    int status = 0;
+    if (trace_write(fd, TRACE_MAGIC, 8) != 0
+        || trace_write(fd, &count, sizeof(count)) != 0
+        || trace_write(fd, &trace_buffer[start], chunk * sizeof(TraceEvent)) != 0
+        || trace_write(fd, &trace_buffer[0], (count - chunk) * sizeof(TraceEvent)) != 0){
+        status = -1;
+    }
+    if (close(fd) != 0){
+        status = -1;
+    }
+    return status;
+}
+#endif
+
+static const char *trace_phase_name(int phase){
+    switch (phase){
+        case PHASE_TICK: return "tick";
+        case PHASE_RENDER: return "render";
+        case PHASE_LEVEL: return "level";
+        case PHASE_INPUT: return "input";
+        case PHASE_MOVE: return "move";
+        case PHASE_COLLISION: return "collision";
+        case PHASE_RESCUE: return "rescue";
+        case PHASE_SLEEP: return "sleep";
+        case PHASE_BROADCAST: return "broadcast";
+    }
+    return "unknown";
+}
+
+int trace_to_chrome(const char *trace_path, const char *json_path){
+    // Convert a binary trace into the Chrome trace event format (loads in chrome://tracing and Perfetto)
+    FILE *in = fopen(trace_path, "rb");
+    if (in == NULL){
+        fprintf(stderr, "Cannot open trace file %s\n", trace_path);
+        return 1;
+    }
+
+    char magic[8];
+    uint64_t count;
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 || fread(&count, sizeof(count), 1, in) != 1){
+        fprintf(stderr, "%s is not a RoboIO trace\n", trace_path);
+        fclose(in);
+        return 1;
+    }
+
+    FILE *out = fopen(json_path, "w");
+    if (out == NULL){
+        fprintf(stderr, "Cannot create %s\n", json_path);
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    TraceEvent event;
+    uint64_t written = 0;
+    uint64_t last_ts = 0;
+    int open_phases[64]; // Phases begun but not yet ended, innermost last
+    int open_count = 0;
+    for (uint64_t i = 0; i < count && fread(&event, sizeof(event), 1, in) == 1; i++){
+        const char *separator = written == 0 ? "" : ",\n";
+        unsigned long long ts = (unsigned long long)event.timestamp;
+        last_ts = event.timestamp;
+        if (event.type == TRACE_PHASE_BEGIN){
+            if (open_count == 64){
+                continue; // Nested too deep to be matched with its end
+            }
+            open_phases[open_count++] = event.value;
+        } else if (event.type == TRACE_PHASE_END){
+            if (open_count == 0){
+                continue; // Its begin was overwritten when the ring buffer wrapped around
+            }
+            open_count--;
+        }
+
+        switch (event.type){
+            case TRACE_PHASE_BEGIN:
+            case TRACE_PHASE_END:
+                fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":1,\"tid\":1}", separator, trace_phase_name(event.value), event.type == TRACE_PHASE_BEGIN ? "B" : "E", ts);
+                break;
+            case TRACE_DIRECTION:
+            case TRACE_AI_DECISION:
+            case TRACE_AI_FALLBACK:
+                fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"robot\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"x\":%d,\"y\":%d,\"direction\":\"%c\"}}", separator,
+                        event.type == TRACE_DIRECTION ? "direction" : (event.type == TRACE_AI_DECISION ? "ai_decision" : "ai_fallback"), ts, event.x, event.y, (char)event.value);
+                break;
+            case TRACE_COLLISION:
+                fprintf(out, "%s{\"name\":\"collision\",\"cat\":\"game\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"x\":%d,\"y\":%d,\"type\":\"%s\"}}", separator, ts, event.x, event.y, event.value == 1 ? "wall" : "mine");
+                break;
+            case TRACE_RESCUE:
+                fprintf(out, "%s{\"name\":\"rescue\",\"cat\":\"game\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"x\":%d,\"y\":%d,\"score\":%u}}", separator, ts, event.x, event.y, event.value);
+                break;
+            case TRACE_LEVEL_UP:
+                fprintf(out, "%s{\"name\":\"level_up\",\"cat\":\"game\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"level\":%u,\"mines\":%d}}", separator, ts, event.value, event.x);
+                break;
+            case TRACE_MINE_SHUFFLE:
+                fprintf(out, "%s{\"name\":\"mine_shuffle\",\"cat\":\"game\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"mines\":%u}}", separator, ts, event.value);
+                break;
+            default:
+                continue; // Skip unknown records
+        }
+        written++;
+    }
+
+    // Close phases left open, e.g. when the game was interrupted in the middle of a tick
+    while (open_count > 0){
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"E\",\"ts\":%llu,\"pid\":1,\"tid\":1}", written == 0 ? "" : ",\n", trace_phase_name(open_phases[--open_count]), (unsigned long long)last_ts);
+        written++;
+    }
+    fprintf(out, "\n]}\n");
+
+    fclose(out);
+    fclose(in);
+    printf("Wrote %llu events to %s\n", (unsigned long long)written, json_path);
+    return 0;
+}
+
+#ifdef ROBOIO_AUDIT
+// The wrappers below call the real functions
+#undef malloc
+#undef realloc
+#undef free
+#undef newwin
+#undef delwin
+
+// Stored in front of every block so that free knows how many bytes are released
+typedef union {
+    size_t size;
+    long double align;
+} AuditHeader;
+
+typedef struct {
+    long allocations;
+    long frees;
+    long bytes;
+    long windows;
+} AuditCounters;
+
+static AuditCounters audit_phase[AUDIT_PHASES];
+static int audit_current = AUDIT_SETUP;
+static long audit_live_bytes = 0;
+static long audit_peak_bytes = 0;
+static long audit_live_blocks = 0;
+static long audit_live_windows = 0;
+static long audit_ticks = 0;
+static long audit_tick_allocations = 0; // Allocations made during the current tick
+static long audit_max_tick_allocations = 0;
+static long audit_bad_ticks = 0; // Steady-state ticks that allocated
+static long audit_first_bad_tick = 0;
+static int audit_first_bad_line = 0;
+
+static void audit_count(long bytes, int line){
+    // Record one allocation (or window) in the current phase and tick
+    audit_phase[audit_current].allocations++;
+    audit_phase[audit_current].bytes += bytes;
+    if (audit_current == AUDIT_TICK){
+        audit_tick_allocations++;
+        if (audit_first_bad_line == 0){
+            audit_first_bad_tick = audit_ticks;
+            audit_first_bad_line = line;
+        }
+    }
+}
+
+void *audit_malloc(size_t size, int line){
+    AuditHeader *header = malloc(sizeof(AuditHeader) + size);
+    if (header == NULL){
+        return NULL;
+    }
+    header->size = size;
+    audit_count((long)size, line);
+    audit_live_blocks++;
+    audit_live_bytes += (long)size;
+    if (audit_live_bytes > audit_peak_bytes){
+        audit_peak_bytes = audit_live_bytes;
+    }
+    return header + 1;
+}
+
+void *audit_realloc(void *pointer, size_t size, int line){
+    if (pointer == NULL){
+        return audit_malloc(size, line);
+    }
+
+    AuditHeader *header = (AuditHeader *)pointer - 1;
+    size_t old_size = header->size;
+    AuditHeader *new_header = realloc(header, sizeof(AuditHeader) + size);
+    if (new_header == NULL){
+        return NULL;
+    }
+    new_header->size = size;
+    audit_count((long)size, line);
+    audit_live_bytes += (long)size - (long)old_size;
+    if (audit_live_bytes > audit_peak_bytes){
+        audit_peak_bytes = audit_live_bytes;
+    }
+    return new_header + 1;
+}
+
+void audit_free(void *pointer){
+    if (pointer == NULL){
+        return;
+    }
+    AuditHeader *header = (AuditHeader *)pointer - 1;
+    audit_phase[audit_current].frees++;
+    audit_live_blocks--;
+    audit_live_bytes -= (long)header->size;
+    free(header);
+}
+
+WINDOW *audit_newwin(int rows, int cols, int y, int x, int line){
+    WINDOW *window = newwin(rows, cols, y, x);
+    if (window != NULL){
+        audit_count(0, line);
+        audit_phase[audit_current].windows++;
+        audit_live_windows++;
+    }
+    return window;
+}
+
+int audit_delwin(WINDOW *window){
+    if (window != NULL){
+        audit_live_windows--;
+    }
+    return delwin(window);
+}
+
+void audit_set_phase(int phase){
+    audit_current = phase;
+}
+
+void audit_tick_begin(void){
+    audit_ticks++;
+    audit_tick_allocations = 0;
+}
+
+void audit_tick_end(void){
+    if (audit_tick_allocations > audit_max_tick_allocations){
+        audit_max_tick_allocations = audit_tick_allocations;
+    }
+    if (audit_tick_allocations > 0){
+        audit_bad_ticks++;
+    }
+}
+
+int audit_report(void){
+    // Print the audit after endwin and return the exit status of the game
+    const char *phase_names[AUDIT_PHASES] = {"setup", "ticks", "game over"};
+    int failed = 0;
+
+    fprintf(stderr, "Allocation audit\n");
+    for (int i = 0; i < AUDIT_PHASES; i++){
+        fprintf(stderr, "  %-10s %ld allocations (%ld bytes, %ld windows), %ld frees\n", phase_names[i],
+                audit_phase[i].allocations, audit_phase[i].bytes, audit_phase[i].windows, audit_phase[i].frees);
+    }
+    fprintf(stderr, "  %ld ticks, at most %ld allocations in one tick\n", audit_ticks, audit_max_tick_allocations);
+    fprintf(stderr, "  Peak live bytes: %ld\n", audit_peak_bytes);
+
+    if (audit_live_blocks != 0 || audit_live_windows != 0){
+        fprintf(stderr, "  LEAK: %ld blocks (%ld bytes) and %ld windows still live at exit\n", audit_live_blocks, audit_live_bytes, audit_live_windows);
+        failed = 1;
+    }
+    if (audit_bad_ticks != 0){
+        fprintf(stderr, "  FAIL: %ld ticks allocated, first at tick %ld (game.c:%d)\n", audit_bad_ticks, audit_first_bad_tick, audit_first_bad_line);
+        failed = 1;
+    }
+    if (!failed){
+        fprintf(stderr, "  OK: no leaks and no allocations in any tick\n");
+    }
+    return failed ? EXIT_FAILURE : 0;
+}
+#endif